@@ -1,12 +1,133 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <chrono>
+#ifndef _WIN32
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
 #include "Processor.h"
 #include "Debug.hpp"
 
-Processor::Processor(std::string const & kernelPath, DeviceType deviceType, std::string const & kernelArgs)
-  : _kernelPath(kernelPath), _kernelArgs(kernelArgs),
-    _currentPlatform(nullptr), _currentDevice(nullptr), _context(nullptr), _program(nullptr), _queue(nullptr)
+static unsigned int ChannelCount(cl_channel_order order)
+{
+  switch (order) {
+    case CL_R: return 1;
+    case CL_RG: return 2;
+    case CL_RGB: return 3;
+    default: return 4;
+  }
+}
+
+static size_t SampleSize(cl_channel_type type)
+{
+  return type == CL_UNORM_INT8 ? 1 : 2;
+}
+
+static cl_half FloatToHalfBits(float value)
+{
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+
+  uint32_t sign = (bits >> 16) & 0x8000;
+  int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = bits & 0x7fffff;
+
+  // Inf and NaN
+  if (((bits >> 23) & 0xff) == 0xff)
+    return sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0);
+  if (exponent >= 31)
+    return sign | 0x7c00;
+
+  // Denormals, rounded to nearest even like the normal path
+  if (exponent <= 0)
+  {
+    if (exponent < -10)
+      return sign;
+    mantissa |= 0x800000;
+    uint32_t shift = 14 - exponent;
+    uint32_t half = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1)))
+      ++half;
+    return sign | half;
+  }
+
+  uint32_t half = (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+  uint32_t rest = mantissa & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+    ++half;
+  return sign | half;
+}
+
+static float HalfBitsToFloat(cl_half value)
+{
+  uint32_t sign = (value & 0x8000) << 16;
+  uint32_t exponent = (value >> 10) & 0x1f;
+  uint32_t mantissa = value & 0x3ff;
+
+  if (exponent == 0)
+  {
+    float result = std::ldexp(static_cast<float>(mantissa), -24);
+    return sign ? -result : result;
+  }
+
+  uint32_t bits = sign | (mantissa << 13) | (exponent == 31 ? 0x7f800000 : (exponent + 112) << 23);
+  float result;
+  std::memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+// Samples are exchanged as normalized floats
+static float ReadSample(char const *sample, cl_channel_type type)
+{
+  if (type == CL_UNORM_INT16)
+  {
+    uint16_t value;
+    std::memcpy(&value, sample, sizeof(value));
+    return value / 65535.0f;
+  }
+  if (type == CL_HALF_FLOAT)
+  {
+    cl_half value;
+    std::memcpy(&value, sample, sizeof(value));
+    return HalfBitsToFloat(value);
+  }
+  return static_cast<unsigned char>(*sample) / 255.0f;
+}
+
+static void WriteSample(char *sample, cl_channel_type type, float value)
+{
+  if (type == CL_HALF_FLOAT)
+  {
+    cl_half half = FloatToHalfBits(value);
+    std::memcpy(sample, &half, sizeof(half));
+    return;
+  }
+
+  value = std::min(std::max(value, 0.0f), 1.0f);
+  if (type == CL_UNORM_INT16)
+  {
+    uint16_t normalized = static_cast<uint16_t>(value * 65535.0f + 0.5f);
+    std::memcpy(sample, &normalized, sizeof(normalized));
+  }
+  else
+    *sample = static_cast<char>(static_cast<unsigned char>(value * 255.0f + 0.5f));
+}
+
+Processor::Processor(std::string const & kernelPath, DeviceType deviceType, std::string const & kernelArgs,
+                     StartupMode startupMode, LogLevel logLevel, BufferStorage bufferStorage)
+  : _kernelPath(kernelPath), _kernelArgs(kernelArgs), _startupMode(startupMode), _logLevel(logLevel),
+    _currentPlatform(nullptr), _currentDevice(nullptr), _halfStorage(bufferStorage == Half_Storage), _context(nullptr), _program(nullptr), _queue(nullptr),
+    _streamQueue(nullptr), _streamChunkSize(0), _buildPending(false)
 {
   _deviceType = LookupDevice(deviceType);
   init(0, 1);
@@ -14,12 +135,21 @@ Processor::Processor(std::string const & kernelPath, DeviceType deviceType, std:
 
 Processor::~Processor()
 {
+  // The build callback still references this object
+  waitForBuild();
+
+  for (auto const & kernel : _kernels)
+    clReleaseKernel(kernel.second);
+  if (_streamQueue != nullptr)
+    clReleaseCommandQueue(_streamQueue);
   if (_queue != nullptr)
     clReleaseCommandQueue(_queue);
   if (_program != nullptr)
     clReleaseProgram(_program);
   if (_context != nullptr)
     clReleaseContext(_context);
+
+  flushLog();
 }
 
 void Processor::init(int selectedPlatform, int selectedDevice)
@@ -30,10 +160,20 @@ void Processor::init(int selectedPlatform, int selectedDevice)
   _devices = loadDevices(_currentPlatform, _deviceType);
   _currentDevice = _devices[selectedDevice];
 
-  _context = createContext(_currentPlatform);
-  _program = createProgram(_context, _kernelPath, _kernelArgs);
+  // Buffers are only converted when the program is told so through this define
+  if (_halfStorage && !HasDeviceExtension(_currentDevice, "cl_khr_fp16"))
+  {
+    _halfStorage = false;
+    log("Device does not support half precision, buffers are kept as float");
+  }
+  if (_halfStorage)
+    _kernelArgs += " -D PROCCL_FP16";
 
+  _context = createContext(_currentPlatform);
+  // Created first as nothing may throw once an asynchronous build references this object
   _queue = createCommandQueue(_currentDevice, _context);
+
+  _program = createProgram(_context, _kernelPath, _kernelArgs);
 }
 
 std::vector<cl_platform_id> Processor::loadPlateforms()
@@ -49,8 +189,9 @@ std::vector<cl_platform_id> Processor::loadPlateforms()
 	std::vector<cl_platform_id> platformIds(platformIdCount);
 	clGetPlatformIDs(platformIdCount, platformIds.data(), nullptr);
 
-	for (cl_platform_id platformId : platformIds)
-		log(std::string("\t" + GetPlatformName(platformId)));
+  if (logEnabled(Debug_Log))
+    for (cl_platform_id platformId : platformIds)
+      log(std::string("\t" + GetPlatformName(platformId)), Debug_Log);
 
   return platformIds;
 }
@@ -63,13 +204,17 @@ std::vector<cl_device_id> Processor::loadDevices(cl_platform_id platformId, cl_d
 	if (deviceIdCount == 0)
 		throwError("No OpenCL devices found for given device type ");
   else
-    log(std::string("Found ") + std::to_string(deviceIdCount) + " device(s) for platform " + GetPlatformName(platformId));
+    log(std::string("Found ") + std::to_string(deviceIdCount) + " device(s)");
 
 	std::vector<cl_device_id> deviceIds (deviceIdCount);
 	clGetDeviceIDs(platformId, deviceType, deviceIdCount, deviceIds.data(), nullptr);
 
-	for (cl_device_id deviceId : deviceIds)
-		log(std::string("\t" + GetDeviceName(deviceId)));
+  if (logEnabled(Debug_Log))
+  {
+    log(std::string("Devices for platform ") + GetPlatformName(platformId), Debug_Log);
+    for (cl_device_id deviceId : deviceIds)
+      log(std::string("\t" + GetDeviceName(deviceId)), Debug_Log);
+  }
 
   return deviceIds;
 }
@@ -81,8 +226,10 @@ cl_context Processor::createContext(cl_platform_id platformId)
 		CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties>(platformId), 0
 	};
 
+	std::vector<cl_device_id> devices(buildDevices());
+
 	cl_int error = CL_SUCCESS;
-	cl_context context = clCreateContext(contextProperties, _devices.size(), _devices.data(), nullptr, nullptr, &error);
+	cl_context context = clCreateContext(contextProperties, devices.size(), devices.data(), nullptr, nullptr, &error);
 	checkError(error);
 
 	return context;
@@ -109,11 +256,30 @@ cl_program Processor::createProgram(cl_context context, std::string const & kern
 	cl_program program = clCreateProgramWithSource(context, 1, sources, lengths, &error);
 	checkError(error);
 
-  error = clBuildProgram(program, _devices.size(), _devices.data(), kernelArgs.c_str(), nullptr, nullptr);
+  std::vector<cl_device_id> devices(buildDevices());
+
+  if (_startupMode == Fast_Startup)
+  {
+    // Only flagged as pending once the callback is guaranteed to run
+    {
+      std::lock_guard<std::mutex> lock(_buildMutex);
+      _buildPending = true;
+    }
+    error = clBuildProgram(program, devices.size(), devices.data(), kernelArgs.c_str(), &Processor::BuildNotify, this);
+    if (error != CL_SUCCESS)
+    {
+      std::lock_guard<std::mutex> lock(_buildMutex);
+      _buildPending = false;
+    }
+  }
+  else
+    error = clBuildProgram(program, devices.size(), devices.data(), kernelArgs.c_str(), nullptr, nullptr);
+
   if (error != CL_SUCCESS)
   {
-    for (cl_device_id device : _devices)
-      log(std::string("Build error: ") + GetProgramBuildLog(device, program));
+    for (cl_device_id device : devices)
+      log(std::string("Build error: ") + GetProgramBuildLog(device, program), Error_Log);
+    clReleaseProgram(program);
   }
   checkError(error);
 
@@ -129,9 +295,109 @@ cl_command_queue Processor::createCommandQueue(cl_device_id deviceId, cl_context
   return queue;
 }
 
-void Processor::prepareArguments(cl_kernel kernel, std::list<KernelArg> const & args, InputArg& input, OutputArg& output, std::list<InternalArg>& internalArgs)
+std::vector<cl_device_id> Processor::buildDevices() const
+{
+  if (_startupMode == Fast_Startup)
+    return std::vector<cl_device_id>(1, _currentDevice);
+  return _devices;
+}
+
+void CL_CALLBACK Processor::BuildNotify(cl_program, void *userData)
+{
+  Processor *self = static_cast<Processor*>(userData);
+
+  std::lock_guard<std::mutex> lock(self->_buildMutex);
+  self->_buildPending = false;
+  self->_buildDone.notify_all();
+}
+
+void Processor::waitForBuild()
+{
+  std::unique_lock<std::mutex> lock(_buildMutex);
+  _buildDone.wait(lock, [this] { return !_buildPending; });
+}
+
+cl_kernel Processor::getKernel(std::string const & name)
+{
+  auto found = _kernels.find(name);
+  if (found != _kernels.end())
+    return found->second;
+
+  if (_startupMode == Fast_Startup)
+  {
+    waitForBuild();
+
+    cl_build_status status = CL_BUILD_NONE;
+    checkError(clGetProgramBuildInfo(_program, _currentDevice, CL_PROGRAM_BUILD_STATUS, sizeof(status), &status, nullptr));
+    if (status != CL_BUILD_SUCCESS)
+    {
+      log(std::string("Build error: ") + GetProgramBuildLog(_currentDevice, _program), Error_Log);
+      checkError(CL_BUILD_PROGRAM_FAILURE);
+    }
+  }
+
+	cl_int error = 0;
+	cl_kernel kernel = clCreateKernel(_program, name.c_str(), &error);
+	checkError(error);
+
+  _kernels[name] = kernel;
+  return kernel;
+}
+
+std::list<Processor::DeviceImage> Processor::loadInputImages(std::list<KernelArg> const & args)
+{
+  std::list<DeviceImage> images;
+
+  for (KernelArg const & arg : args)
+    if (arg.type == KernelArg::IMAGE && arg.direction != KernelArg::OUTPUT)
+    {
+      Image image(loadImage(std::string(static_cast<char*>(arg.data))));
+      cl_image_format hostFormat = image.format;
+      cl_image_format format = selectImageFormat(CL_MEM_READ_ONLY, hostFormat);
+      images.emplace_back(ConvertImage(std::move(image), format), hostFormat);
+    }
+
+  return images;
+}
+
+cl_image_format Processor::selectImageFormat(cl_mem_flags flags, cl_image_format const & hostFormat)
+{
+  cl_uint count = 0;
+  checkError(clGetSupportedImageFormats(_context, flags, CL_MEM_OBJECT_IMAGE2D, 0, nullptr, &count));
+
+  std::vector<cl_image_format> supported(count);
+  checkError(clGetSupportedImageFormats(_context, flags, CL_MEM_OBJECT_IMAGE2D, count, supported.data(), nullptr));
+
+  // Most compact order able to hold every channel first, 16-bit data may fall back to half floats.
+  // CL_RGB only exists with packed types, so RGB data is still padded to CL_RGBA
+  cl_channel_order const orders[] = { CL_R, CL_RG, CL_RGBA };
+  std::vector<cl_channel_type> types(1, hostFormat.image_channel_data_type);
+  if (hostFormat.image_channel_data_type == CL_UNORM_INT16)
+    types.push_back(CL_HALF_FLOAT);
+
+  for (cl_channel_order order : orders)
+  {
+    if (ChannelCount(order) < ChannelCount(hostFormat.image_channel_order))
+      continue;
+    for (cl_channel_type type : types)
+      for (cl_image_format const & format : supported)
+        if (format.image_channel_order == order && format.image_channel_data_type == type)
+        {
+          log(std::string("Using ") + std::to_string(ChannelCount(order)) + " channel(s) of "
+              + std::to_string(SampleSize(type)) + " byte(s) for image", Debug_Log);
+          return format;
+        }
+  }
+
+  throwError("No supported image format for " + std::to_string(ChannelCount(hostFormat.image_channel_order)) + " channel(s)");
+  return hostFormat;
+}
+
+void Processor::prepareArguments(cl_kernel kernel, std::list<KernelArg> const & args, std::list<DeviceImage> const & images,
+                                 InputArg& input, OutputArg& output, std::list<InternalArg>& internalArgs)
 {
 	cl_int error = 0;
+  auto nextImage = images.begin();
 
   unsigned int index = 0;
   for (KernelArg arg : args)
@@ -146,13 +412,30 @@ void Processor::prepareArguments(cl_kernel kernel, std::list<KernelArg> const &
       int flags = arg.direction == KernelArg::STATIC || arg.direction == KernelArg::INPUT ? CL_MEM_READ_ONLY : CL_MEM_WRITE_ONLY;
       flags |= arg.copy ? CL_MEM_COPY_HOST_PTR : 0;
 
+      bool half = false;
+      cl_image_format imageFormat = input.imageFormat;
+
       if (arg.type == KernelArg::BUFFER)
       {
-        buffer = clCreateBuffer(_context, flags, arg.size, arg.copy ? arg.data : nullptr, &error);
+        void *data = arg.data;
+        size_t bufferSize = arg.size;
+
+        std::vector<cl_half> halfData;
+        half = _halfStorage;
+        if (half)
+        {
+          if (arg.size % sizeof(float) != 0)
+            throwError("Half storage needs float buffers, got a size of " + std::to_string(arg.size) + " bytes");
+          halfData = FloatToHalf(static_cast<float const *>(arg.data), arg.size / sizeof(float));
+          data = halfData.data();
+          bufferSize = halfData.size() * sizeof(cl_half);
+        }
+
+        buffer = clCreateBuffer(_context, flags, bufferSize, arg.copy ? data : nullptr, &error);
         if (!arg.copy)
         {
           checkError(error);
-          error = clEnqueueWriteBuffer(_queue, buffer, CL_TRUE, 0, arg.size, arg.data, 0, nullptr, nullptr);
+          error = clEnqueueWriteBuffer(_queue, buffer, CL_TRUE, 0, bufferSize, data, 0, nullptr, nullptr);
         }
         if (arg.direction == KernelArg::INPUT)
         {
@@ -163,39 +446,49 @@ void Processor::prepareArguments(cl_kernel kernel, std::list<KernelArg> const &
       }
       else if (arg.type == KernelArg::IMAGE)
       {
-        cl_image_format format = { CL_RGBA, CL_UNORM_INT8 };
-        Image image(0, 0);
+        // Output images mirror the host format of the input, stored as compactly as the device allows
+        Image outputImage(0, 0, input.imageFormat);
+        Image const *image = &outputImage;
         if (arg.direction == KernelArg::OUTPUT)
         {
           flags = flags & ~CL_MEM_COPY_HOST_PTR;
-          image = Image(input.sizes[0], input.sizes[1]);
+          outputImage = Image(input.sizes[0], input.sizes[1], selectImageFormat(CL_MEM_WRITE_ONLY, input.imageFormat));
+          imageFormat = outputImage.format;
         }
         else
-          image = RGBtoRGBA(loadImage(std::string(static_cast<char*>(arg.data))));
+        {
+          image = &nextImage->image;
+          imageFormat = nextImage->hostFormat;
+          ++nextImage;
+        }
 
-        void *imgData = arg.direction == KernelArg::OUTPUT ? nullptr : const_cast<char*>(image.pixel.data());
+        void *imgData = arg.direction == KernelArg::OUTPUT ? nullptr : const_cast<char*>(image->pixel.data());
 
-        buffer = clCreateImage2D(_context, flags, &format, image.width, image.height, 0, arg.copy ? imgData : nullptr, &error);
+        buffer = clCreateImage2D(_context, flags, &image->format, image->width, image->height, 0, arg.copy ? imgData : nullptr, &error);
         if (!arg.copy && arg.direction != KernelArg::OUTPUT)
         {
           checkError(error);
         	std::size_t origin[3] = { 0, 0, 0 };
-        	std::size_t region[3] = { image.width, image.height, 1 };
+        	std::size_t region[3] = { image->width, image->height, 1 };
           error = clEnqueueWriteImage(_queue, buffer, CL_TRUE, origin, region, 0, 0, imgData, 0, nullptr, nullptr);
         }
         if (arg.direction == KernelArg::INPUT)
         {
           input.dim = 2;
-          input.sizes[0] = image.width;
-          input.sizes[1] = image.height;
+          input.sizes[0] = image->width;
+          input.sizes[1] = image->height;
           input.sizes[2] = 0;
+          input.imageFormat = imageFormat;
         }
       }
       checkError(error);
       size = sizeof(cl_mem);
 
       if (arg.direction == KernelArg::OUTPUT)
-        output = OutputArg(arg.type, buffer, arg.data, arg.size);
+      {
+        output = OutputArg(arg.type, buffer, arg.data, arg.size, half);
+        output.imageFormat = imageFormat;
+      }
 
       iarg = InternalArg(buffer);
       internalArgs.push_back(iarg);
@@ -215,40 +508,273 @@ void Processor::execute(std::string const & kernelFunction, std::list<KernelArg>
 {
 	cl_int error = 0;
 
-	cl_kernel kernel = clCreateKernel(_program, kernelFunction.c_str(), &error);
-	checkError(error);
+  for (KernelArg const & arg : args)
+    if (arg.type == KernelArg::STREAM)
+    {
+      executeStream(kernelFunction, args);
+      return;
+    }
+
+  // Host-side loading happens first so it overlaps with an asynchronous build
+  std::list<DeviceImage> images(loadInputImages(args));
+	cl_kernel kernel = getKernel(kernelFunction);
 
   std::list<InternalArg> internalArgs;
   InputArg input(0);
   OutputArg output(KernelArg::RAW, nullptr, nullptr, 0);
-  prepareArguments(kernel, args, input, output, internalArgs);
+  prepareArguments(kernel, args, images, input, output, internalArgs);
 
 	checkError(clEnqueueNDRangeKernel(_queue, kernel, input.dim, nullptr, input.sizes, nullptr, 0, nullptr, nullptr));
 
-  if (output.type == KernelArg::BUFFER)
+  if (output.type == KernelArg::BUFFER && output.half)
+  {
+    std::vector<cl_half> result(output.size / sizeof(float));
+    error = clEnqueueReadBuffer(_queue, output.buffer, CL_TRUE, 0, result.size() * sizeof(cl_half), result.data(), 0, nullptr, nullptr);
+    HalfToFloat(result, static_cast<float*>(output.data));
+  }
+  else if (output.type == KernelArg::BUFFER)
     error = clEnqueueReadBuffer(_queue, output.buffer, CL_TRUE, 0, output.size, output.data, 0, nullptr, nullptr);
   else if (output.type == KernelArg::IMAGE)
   {
-  	Image result(input.sizes[0], input.sizes[1], std::vector<char>(input.sizes[0] * input.sizes[1] * 4));
-  	std::fill(result.pixel.begin(), result.pixel.end(), 0);
+    cl_image_format const & format = output.imageFormat;
+  	Image result(input.sizes[0], input.sizes[1], format,
+                 std::vector<char>(input.sizes[0] * input.sizes[1] * ChannelCount(format.image_channel_order) * SampleSize(format.image_channel_data_type)));
 
   	std::size_t origin[3] = { 0, 0, 0 };
   	std::size_t region[3] = { result.width, result.height, 1 };
   	error = clEnqueueReadImage(_queue, output.buffer, CL_TRUE, origin, region, 0, 0, result.pixel.data(), 0, nullptr, nullptr);
 
-    saveImage(RGBAtoRGB(result), std::string(static_cast<char*>(output.data)));
+    saveImage(ConvertImage(std::move(result), input.imageFormat), std::string(static_cast<char*>(output.data)));
   }
   checkError(error);
 
   for (InternalArg arg : internalArgs)
     clReleaseMemObject(arg.buffer);
+}
+
+Processor::StreamArg::StreamArg(KernelArg const & _arg, cl_uint _index)
+  : arg(_arg), index(_index), data(nullptr), size(0), buffers{ nullptr, nullptr }
+{}
+
+Processor::StreamArg::~StreamArg()
+{
+  for (cl_mem buffer : buffers)
+    if (buffer != nullptr)
+      clReleaseMemObject(buffer);
+#ifndef _WIN32
+  if (data != nullptr)
+    munmap(data, size);
+#endif
+}
+
+void Processor::mapStream(StreamArg& stream, size_t size)
+{
+#ifdef _WIN32
+  (void)stream;
+  (void)size;
+  throwError("STREAM arguments rely on POSIX memory mapping and are not supported on Windows");
+#else
+  std::string path(static_cast<char*>(stream.arg.data));
+  bool output = stream.arg.direction == KernelArg::OUTPUT;
+  // Only fresh outputs are created and sized here, in place outputs must already match the inputs
+  bool create = output && !stream.arg.copy;
+
+  int fd = create ? open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644) : open(path.c_str(), output ? O_RDWR : O_RDONLY);
+  if (fd < 0)
+    throwError(std::string("Cannot open stream '") + path + "'");
+
+  struct stat info;
+  if (create)
+  {
+    if (ftruncate(fd, size) != 0)
+    {
+      close(fd);
+      throwError(std::string("Cannot resize stream '") + path + "'");
+    }
+  }
+  else
+  {
+    size_t expected = size;
+    if (fstat(fd, &info) != 0)
+    {
+      close(fd);
+      throwError(std::string("Cannot stat stream '") + path + "'");
+    }
+    size = info.st_size;
+    if (output && size != expected)
+    {
+      close(fd);
+      throwError(std::string("Stream '") + path + "' holds " + std::to_string(size) + " bytes, expected " + std::to_string(expected));
+    }
+  }
+
+  if (size == 0)
+  {
+    close(fd);
+    throwError(std::string("Empty stream '") + path + "'");
+  }
+
+  void *data = mmap(nullptr, size, output ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    throwError(std::string("Cannot map stream '") + path + "'");
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  stream.data = static_cast<char*>(data);
+  stream.size = size;
+#endif
+}
+
+void Processor::executeStream(std::string const & kernelFunction, std::list<KernelArg> const & args)
+{
+  std::list<StreamArg> streams;
+
+  cl_uint index = 0;
+  for (KernelArg const & arg : args)
+  {
+    if (arg.type == KernelArg::STREAM)
+    {
+      if (arg.size == 0)
+        throwError("Stream argument needs an element size");
+      streams.emplace_back(arg, index);
+    }
+    else if (arg.type != KernelArg::RAW)
+      throwError("Stream arguments can only be combined with RAW arguments");
+    ++index;
+  }
+
+  // Every input has to hold the same number of elements, outputs are sized from it
+  size_t count = 0;
+  bool hasInput = false;
+  for (StreamArg& stream : streams)
+    if (stream.arg.direction != KernelArg::OUTPUT)
+    {
+      mapStream(stream, 0);
+      if (stream.size % stream.arg.size != 0)
+        throwError(std::string("Stream '") + static_cast<char*>(stream.arg.data) + "' holds " + std::to_string(stream.size)
+                   + " bytes, not a multiple of its element size " + std::to_string(stream.arg.size));
+      if (hasInput && stream.size / stream.arg.size != count)
+        throwError("Stream inputs have different lengths");
+      count = stream.size / stream.arg.size;
+      hasInput = true;
+    }
+  if (!hasInput)
+    throwError("No input parameter specified");
+  if (count == 0)
+    throwError("Stream inputs hold no element");
+
+  size_t elementSize = 0;
+  bool hasOutput = false;
+  for (StreamArg& stream : streams)
+  {
+    if (stream.arg.direction == KernelArg::OUTPUT)
+    {
+      mapStream(stream, count * stream.arg.size);
+      hasOutput = true;
+    }
+    elementSize = std::max(elementSize, stream.arg.size);
+  }
+  if (!hasOutput)
+    throwError("No output parameter specified");
+
+  // Two buffer sets per stream are alive at once so transfers of one chunk overlap the other
+  cl_ulong maxAlloc = 0, globalMem = 0;
+  checkError(clGetDeviceInfo(_currentDevice, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxAlloc), &maxAlloc, nullptr));
+  checkError(clGetDeviceInfo(_currentDevice, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(globalMem), &globalMem, nullptr));
+
+  size_t chunkBytes = static_cast<size_t>(std::min<cl_ulong>(maxAlloc,
+    _streamChunkSize != 0 ? _streamChunkSize : globalMem / (4 * streams.size())));
+  size_t chunkCount = std::max<size_t>(std::min(chunkBytes / elementSize, count), 1);
+
+  cl_int error = 0;
+  for (StreamArg& stream : streams)
+  {
+    int flags = stream.arg.direction != KernelArg::OUTPUT ? CL_MEM_READ_ONLY : stream.arg.copy ? CL_MEM_READ_WRITE : CL_MEM_WRITE_ONLY;
+    for (cl_mem& buffer : stream.buffers)
+    {
+      buffer = clCreateBuffer(_context, flags, chunkCount * stream.arg.size, nullptr, &error);
+      checkError(error);
+    }
+  }
+
+  if (_streamQueue == nullptr)
+    _streamQueue = createCommandQueue(_currentDevice, _context);
+
+  // Waiting on the build only now keeps the host-side setup overlapped with it
+  cl_kernel kernel = getKernel(kernelFunction);
+
+  index = 0;
+  for (KernelArg const & arg : args)
+  {
+    if (arg.type == KernelArg::RAW)
+      checkError(clSetKernelArg(kernel, index, arg.size, arg.data));
+    ++index;
+  }
+  cl_command_queue queues[2] = { _queue, _streamQueue };
+
+  log(std::string("Streaming ") + std::to_string(count) + " element(s) by chunks of " + std::to_string(chunkCount));
+
+  size_t transferred = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  // Pending transfers target the mapped files, they must be done before anything is unmapped
+  try
+  {
+    for (size_t first = 0, chunk = 0; first < count; first += chunkCount, ++chunk)
+    {
+      size_t set = chunk % 2;
+      size_t globalSize = std::min(chunkCount, count - first);
+      cl_command_queue queue = queues[set];
+
+      // Waits for the chunk that last used this buffer set, the other queue keeps running meanwhile
+      checkError(clFinish(queue));
+
+      for (StreamArg& stream : streams)
+      {
+        size_t offset = first * stream.arg.size;
+        size_t bytes = globalSize * stream.arg.size;
+        if (stream.arg.direction != KernelArg::OUTPUT || stream.arg.copy)
+        {
+          checkError(clEnqueueWriteBuffer(queue, stream.buffers[set], CL_FALSE, 0, bytes, stream.data + offset, 0, nullptr, nullptr));
+          transferred += bytes;
+        }
+        checkError(clSetKernelArg(kernel, stream.index, sizeof(cl_mem), &stream.buffers[set]));
+      }
+
+      checkError(clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &globalSize, nullptr, 0, nullptr, nullptr));
+
+      for (StreamArg& stream : streams)
+        if (stream.arg.direction == KernelArg::OUTPUT)
+        {
+          size_t bytes = globalSize * stream.arg.size;
+          checkError(clEnqueueReadBuffer(queue, stream.buffers[set], CL_FALSE, 0, bytes, stream.data + first * stream.arg.size, 0, nullptr, nullptr));
+          transferred += bytes;
+        }
+
+      checkError(clFlush(queue));
+    }
+  }
+  catch (...)
+  {
+    for (cl_command_queue queue : queues)
+      clFinish(queue);
+    throw;
+  }
+
+  for (cl_command_queue queue : queues)
+    checkError(clFinish(queue));
 
-	clReleaseKernel(kernel);
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::ostringstream throughput;
+  throughput << "Streamed " << transferred / 1e9 << " GB in " << seconds << " s ("
+             << (seconds > 0 ? transferred / 1e9 / seconds : 0) << " GB/s)";
+  log(throughput.str());
 }
 
 void Processor::throwError(std::string const & message)
 {
-  log(message);
+  log(message, Error_Log);
+  flushLog();
   printStacktrace();
   throw std::runtime_error(message);
 }
@@ -262,9 +788,16 @@ void Processor::checkError(cl_int error)
 	}
 }
 
-void Processor::log(std::string const & message)
+void Processor::log(std::string const & message, LogLevel level)
 {
-  std::cout << "Processor: " << message << std::endl;
+  if (logEnabled(level))
+    _logBuffer << "Processor: " << message << '\n';
+}
+
+void Processor::flushLog()
+{
+  std::cout << _logBuffer.str() << std::flush;
+  _logBuffer.str(std::string());
 }
 
 Processor::Image Processor::loadImage(std::string const & path)
@@ -277,9 +810,10 @@ Processor::Image Processor::loadImage(std::string const & path)
 	std::string s;
 	in >> s;
 
-	if (s != "P6") {
-    throwError("Bad image format for '" + path + "', only PPM supported");
+	if (s != "P6" && s != "P5") {
+    throwError("Bad image format for '" + path + "', only PPM and PGM supported");
 	}
+	cl_channel_order order = s == "P5" ? CL_R : CL_RGB;
 
 	// Skip comments
 	for (;;) {
@@ -297,8 +831,8 @@ Processor::Image Processor::loadImage(std::string const & path)
 	str >> width >> height;
 	in >> maxColor;
 
-	if (maxColor != 255) {
-    throwError("Bad max color for '" + path + "', should be 255");
+	if (maxColor == 0 || maxColor > 65535) {
+    throwError("Bad max color for '" + path + "', should be between 1 and 65535");
 	}
 
 	{
@@ -307,10 +841,24 @@ Processor::Image Processor::loadImage(std::string const & path)
 		getline(in, tmp);
 	}
 
-	std::vector<char> data(width * height * 3);
+	cl_image_format format = { order, static_cast<cl_channel_type>(maxColor > 255 ? CL_UNORM_INT16 : CL_UNORM_INT8) };
+	std::vector<char> data(static_cast<size_t>(width) * height * ChannelCount(order) * SampleSize(format.image_channel_data_type));
 	in.read(reinterpret_cast<char*>(data.data()), data.size());
 
-	return Image(width, height, data);
+	// Samples are big-endian and scaled to maxColor in the file
+	if (format.image_channel_data_type == CL_UNORM_INT16) {
+		for (std::size_t i = 0; i < data.size(); i += 2) {
+			uint32_t value = (static_cast<unsigned char>(data[i]) << 8) | static_cast<unsigned char>(data[i + 1]);
+			uint16_t sample = static_cast<uint16_t>(std::min(value, maxColor) * 65535 / maxColor);
+			std::memcpy(&data[i], &sample, sizeof(sample));
+		}
+	}
+	else if (maxColor != 255) {
+		for (char & sample : data)
+			sample = static_cast<char>(std::min<unsigned int>(static_cast<unsigned char>(sample), maxColor) * 255 / maxColor);
+	}
+
+	return Image(width, height, format, data);
 }
 
 void Processor::saveImage(Image const & img, std::string const & path)
@@ -320,37 +868,70 @@ void Processor::saveImage(Image const & img, std::string const & path)
   if (!out.is_open())
     throwError(std::string("Cannot save image '") + path + "'");
 
-	out << "P6\n";
+  bool wide = img.format.image_channel_data_type == CL_UNORM_INT16;
+
+	out << (img.format.image_channel_order == CL_R ? "P5\n" : "P6\n");
 	out << img.width << " " << img.height << "\n";
-	out << "255\n";
-	out.write(img.pixel.data(), img.pixel.size());
+	out << (wide ? "65535\n" : "255\n");
+
+  if (!wide)
+  {
+    out.write(img.pixel.data(), img.pixel.size());
+    return;
+  }
+
+  std::vector<char> data(img.pixel.size());
+  for (std::size_t i = 0; i < data.size(); i += 2) {
+    uint16_t sample;
+    std::memcpy(&sample, &img.pixel[i], sizeof(sample));
+    data[i] = static_cast<char>(sample >> 8);
+    data[i + 1] = static_cast<char>(sample & 0xff);
+  }
+	out.write(data.data(), data.size());
 }
 
-Processor::Image Processor::RGBtoRGBA(Processor::Image const & input)
+Processor::Image Processor::ConvertImage(Processor::Image input, cl_image_format format)
 {
-	Image result(input.width, input.height);
-
-	for (std::size_t i = 0; i < input.pixel.size(); i += 3) {
-		result.pixel.push_back(input.pixel [i + 0]);
-		result.pixel.push_back(input.pixel [i + 1]);
-		result.pixel.push_back(input.pixel [i + 2]);
-		result.pixel.push_back(0);
+  if (input.format.image_channel_order == format.image_channel_order
+      && input.format.image_channel_data_type == format.image_channel_data_type)
+    return input;
+
+  unsigned int inputChannels = ChannelCount(input.format.image_channel_order);
+  unsigned int outputChannels = ChannelCount(format.image_channel_order);
+  size_t inputSize = SampleSize(input.format.image_channel_data_type);
+  size_t outputSize = SampleSize(format.image_channel_data_type);
+  size_t count = static_cast<size_t>(input.width) * input.height;
+
+	Image result(input.width, input.height, format, std::vector<char>(count * outputChannels * outputSize));
+
+  char const *src = input.pixel.data();
+  char *dst = result.pixel.data();
+	for (std::size_t i = 0; i < count; ++i, src += inputChannels * inputSize) {
+    for (unsigned int c = 0; c < outputChannels; ++c, dst += outputSize) {
+      // Grayscale is replicated on the colour channels, other missing channels are zero
+      unsigned int from = c < inputChannels ? c : (inputChannels == 1 && c < 3 ? 0 : inputChannels);
+      float value = from < inputChannels ? ReadSample(src + from * inputSize, input.format.image_channel_data_type) : 0.0f;
+      WriteSample(dst, format.image_channel_data_type, value);
+    }
 	}
 
 	return result;
 }
 
-Processor::Image Processor::RGBAtoRGB(Processor::Image const & input)
+std::vector<cl_half> Processor::FloatToHalf(float const *data, size_t count)
 {
-	Image result(input.width, input.height);
+  std::vector<cl_half> result(count);
 
-	for (std::size_t i = 0; i < input.pixel.size(); i += 4) {
-		result.pixel.push_back(input.pixel [i + 0]);
-		result.pixel.push_back(input.pixel [i + 1]);
-		result.pixel.push_back(input.pixel [i + 2]);
-	}
+  for (std::size_t i = 0; i < count; ++i)
+    result[i] = FloatToHalfBits(data[i]);
 
-	return result;
+  return result;
+}
+
+void Processor::HalfToFloat(std::vector<cl_half> const & data, float *output)
+{
+  for (std::size_t i = 0; i < data.size(); ++i)
+    output[i] = HalfBitsToFloat(data[i]);
 }
 
 cl_device_type Processor::LookupDevice(DeviceType deviceType)
@@ -388,6 +969,27 @@ std::string Processor::GetDeviceName(cl_device_id id)
 	return result;
 }
 
+bool Processor::HasDeviceExtension(cl_device_id id, std::string const & extension)
+{
+	size_t size = 0;
+	clGetDeviceInfo(id, CL_DEVICE_EXTENSIONS, 0, nullptr, &size);
+
+	std::string extensions;
+	extensions.resize(size);
+	clGetDeviceInfo(id, CL_DEVICE_EXTENSIONS, size, const_cast<char*>(extensions.data()), nullptr);
+	// The terminating NUL would otherwise stick to the last extension name
+	std::string::size_type end = extensions.find('\0');
+	if (end != std::string::npos)
+		extensions.resize(end);
+
+	std::istringstream names(extensions);
+	std::string name;
+	while (names >> name)
+		if (name == extension)
+			return true;
+	return false;
+}
+
 std::string Processor::GetProgramBuildLog(cl_device_id deviceId, cl_program program)
 {
   size_t size = 0;
@@ -3,7 +3,12 @@
 
 #include <vector>
 #include <list>
+#include <map>
 #include <string>
+#include <sstream>
+#include <utility>
+#include <mutex>
+#include <condition_variable>
 
 #ifdef __APPLE__
 # include "OpenCL/opencl.h"
@@ -16,7 +21,9 @@ class Processor
 public:
   struct KernelArg
   {
-    enum Type { RAW, BUFFER, IMAGE };
+    // STREAM is a file path mapped in memory and processed by chunks, size is the element size,
+    // it is meant for element-wise kernels and only mixes with RAW arguments
+    enum Type { RAW, BUFFER, IMAGE, STREAM };
     enum Direction { STATIC, INPUT, OUTPUT };
 
     KernelArg(Type _type, void const *_data, size_t _size = 0, bool _copy = false, Direction _direction = STATIC)
@@ -31,11 +38,21 @@ public:
   };
 
   enum DeviceType { All_Devices, CPU_Devices, GPU_Devices };
-
-  Processor(std::string const & kernelPath, DeviceType deviceType = All_Devices, std::string const & kernelArgs = "");
+  // Eager builds the program for every device before returning, Fast only targets the selected device
+  // and builds in the background so the caller can load its inputs meanwhile
+  enum StartupMode { Eager_Startup, Fast_Startup };
+  enum LogLevel { No_Log, Error_Log, Info_Log, Debug_Log };
+  // Half stores every BUFFER argument, which must hold floats, as half when the device supports cl_khr_fp16,
+  // the program is then built with PROCCL_FP16 so kernels know which storage they receive
+  enum BufferStorage { Float_Storage, Half_Storage };
+
+  Processor(std::string const & kernelPath, DeviceType deviceType = All_Devices, std::string const & kernelArgs = "",
+            StartupMode startupMode = Eager_Startup, LogLevel logLevel = Info_Log, BufferStorage bufferStorage = Float_Storage);
   ~Processor();
 
   void execute(std::string const & kernelFunction, std::list<KernelArg> const & kernelArgs);
+  void setStreamChunkSize(size_t bytes) { _streamChunkSize = bytes; }
+  void flushLog();
 
 private:
   struct InternalArg
@@ -48,37 +65,75 @@ private:
   #define MAX_DIM 9
   struct InputArg
   {
-    InputArg(size_t _dim) : dim(_dim) {}
+    InputArg(size_t _dim) : dim(_dim), imageFormat({ CL_RGB, CL_UNORM_INT8 }) {}
 
     size_t dim;
     size_t sizes[MAX_DIM];
+    cl_image_format imageFormat;
   };
 
   struct OutputArg
   {
-    OutputArg(KernelArg::Type _type, cl_mem _buffer, void *_data, size_t _size) : type(_type), buffer(_buffer), data(_data), size(_size) {}
+    OutputArg(KernelArg::Type _type, cl_mem _buffer, void *_data, size_t _size, bool _half = false)
+      : type(_type), buffer(_buffer), data(_data), size(_size), half(_half), imageFormat({ CL_RGBA, CL_UNORM_INT8 })
+    {}
 
     KernelArg::Type type;
     cl_mem buffer;
     void *data;
     size_t size;
+    bool half;
+    cl_image_format imageFormat;
   };
 
+  // Pixels are tightly packed following format, 16-bit samples are in host byte order
   struct Image
   {
-    Image(unsigned int _width, unsigned int _height) : width(_width), height(_height) {}
-    Image(unsigned int _width, unsigned int _height, std::vector<char> const & _pixel)
-      : width(_width), height(_height), pixel(_pixel)
+    Image(unsigned int _width, unsigned int _height, cl_image_format _format)
+      : width(_width), height(_height), format(_format)
+    {}
+    Image(unsigned int _width, unsigned int _height, cl_image_format _format, std::vector<char> const & _pixel)
+      : width(_width), height(_height), format(_format), pixel(_pixel)
     {}
 
-  	std::vector<char> pixel;
-  	unsigned int width;
+    unsigned int width;
     unsigned int height;
+    cl_image_format format;
+    std::vector<char> pixel;
+  };
+
+  struct DeviceImage
+  {
+    DeviceImage(Image _image, cl_image_format _hostFormat) : image(std::move(_image)), hostFormat(_hostFormat) {}
+
+    Image image;
+    cl_image_format hostFormat;
+  };
+
+  // Output streams with copy set are updated in place, others are created with the length of the inputs
+  struct StreamArg
+  {
+    StreamArg(KernelArg const & _arg, cl_uint _index);
+    ~StreamArg();
+
+    StreamArg(StreamArg const &) = delete;
+    StreamArg& operator=(StreamArg const &) = delete;
+
+    KernelArg arg;
+    cl_uint index;
+    char *data;
+    size_t size;
+    cl_mem buffers[2];
   };
 
   void init(int selectedPlatform, int selectedDevice);
 
-  void prepareArguments(cl_kernel kernel, std::list<KernelArg> const & args, InputArg& input, OutputArg& output, std::list<InternalArg>& internalArgs);
+  std::list<DeviceImage> loadInputImages(std::list<KernelArg> const & args);
+  cl_image_format selectImageFormat(cl_mem_flags flags, cl_image_format const & hostFormat);
+  void prepareArguments(cl_kernel kernel, std::list<KernelArg> const & args, std::list<DeviceImage> const & images,
+                        InputArg& input, OutputArg& output, std::list<InternalArg>& internalArgs);
+  void executeStream(std::string const & kernelFunction, std::list<KernelArg> const & args);
+  void mapStream(StreamArg& stream, size_t size);
 
   std::vector<cl_platform_id> loadPlateforms();
   std::vector<cl_device_id> loadDevices(cl_platform_id platformId, cl_device_type deviceType);
@@ -86,36 +141,56 @@ private:
   std::string loadKernel(std::string const & name);
   cl_program createProgram(cl_context context, std::string const & kernelPath, std::string const & kernelArgs);
   cl_command_queue createCommandQueue(cl_device_id deviceId, cl_context context);
+  std::vector<cl_device_id> buildDevices() const;
+  void waitForBuild();
+  cl_kernel getKernel(std::string const & name);
 
   void throwError(std::string const & message);
   void checkError(cl_int error);
-  void log(std::string const & message);
+  bool logEnabled(LogLevel level) const { return level <= _logLevel; }
+  void log(std::string const & message, LogLevel level = Info_Log);
 
   Image loadImage(std::string const & path);
   void saveImage(Image const & img, std::string const & path);
 
-  static Image RGBtoRGBA(Processor::Image const & input);
-  static Image RGBAtoRGB(Processor::Image const & input);
+  static Image ConvertImage(Processor::Image input, cl_image_format format);
+  static std::vector<cl_half> FloatToHalf(float const *data, size_t count);
+  static void HalfToFloat(std::vector<cl_half> const & data, float *output);
+
+  static void CL_CALLBACK BuildNotify(cl_program program, void *userData);
 
   static cl_device_type LookupDevice(DeviceType deviceType);
   static std::string GetPlatformName(cl_platform_id id);
   static std::string GetDeviceName(cl_device_id id);
+  static bool HasDeviceExtension(cl_device_id id, std::string const & extension);
   static std::string GetProgramBuildLog(cl_device_id id, cl_program program);
   static std::string GetErrorString(cl_int error);
 
   std::string _kernelPath;
   std::string _kernelArgs;
   cl_device_type _deviceType;
+  StartupMode _startupMode;
+  LogLevel _logLevel;
+  std::ostringstream _logBuffer;
 
   std::vector<cl_platform_id> _platforms;
   cl_platform_id _currentPlatform;
 
   std::vector<cl_device_id> _devices;
   cl_device_id _currentDevice;
+  bool _halfStorage;
 
   cl_context _context;
   cl_program _program;
   cl_command_queue _queue;
+  cl_command_queue _streamQueue;
+  size_t _streamChunkSize;
+
+  std::mutex _buildMutex;
+  std::condition_variable _buildDone;
+  bool _buildPending;
+
+  std::map<std::string, cl_kernel> _kernels;
 };
 
 #endif
@@ -3,12 +3,21 @@ __constant sampler_t sampler =
     | CLK_ADDRESS_CLAMP_TO_EDGE
     | CLK_FILTER_NEAREST;
 
-float FilterValue(__constant const float* filterWeights, size_t kernelRadius, const int x, const int y)
+// Weights are passed as half storage when the processor was asked to and the device supports it
+#ifdef PROCCL_FP16
+typedef half weight_t;
+# define LoadWeight(weights, i) vload_half(i, weights)
+#else
+typedef float weight_t;
+# define LoadWeight(weights, i) weights[i]
+#endif
+
+float FilterValue(__constant const weight_t* filterWeights, size_t kernelRadius, const int x, const int y)
 {
-  return filterWeights[(x + kernelRadius) + (y + kernelRadius) * (kernelRadius * 2 + 1)];
+  return LoadWeight(filterWeights, (x + kernelRadius) + (y + kernelRadius) * (kernelRadius * 2 + 1));
 }
 
-__kernel void blur(__read_only image2d_t input, __constant float* filterWeights, int kernelRadius, __write_only image2d_t output)
+__kernel void blur(__read_only image2d_t input, __constant weight_t* filterWeights, int kernelRadius, __write_only image2d_t output)
 {
   const int2 pos = {get_global_id(0), get_global_id(1)};
 
@@ -2,6 +2,7 @@
 
 #include <iostream>
 
+#include <algorithm>
 #include <cmath>
 template <typename T>
 float sq(T n)
@@ -49,7 +50,8 @@ int main()
 
     std::cout << "# Launching '" << program << "'" << std::endl;
 
-    Processor p("src/kernels/" + program + ".cl", Processor::All_Devices);
+    Processor p("src/kernels/" + program + ".cl", Processor::All_Devices, "", Processor::Fast_Startup, Processor::Info_Log,
+                program == "blur" ? Processor::Half_Storage : Processor::Float_Storage);
 
     std::list<Processor::KernelArg> args;
 